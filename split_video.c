@@ -31,9 +31,20 @@
  * format handling
  */
 
+#define _GNU_SOURCE
+
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include <libavutil/opt.h>
 #include <libavcodec/avcodec.h>
@@ -41,6 +52,8 @@
 #include <libavutil/common.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/mathematics.h>
+#include <libavutil/md5.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/avutil.h>
 
@@ -51,6 +64,196 @@
 
 #define MAX_FILENAME_LEN 256
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define MAX_CPUS 1024
+
+/* Scene cut detection: luma sampling step and mean difference threshold */
+#define SCENE_SUBSAMPLE 4
+#define SCENE_CUT_THRESHOLD 30
+
+
+/**************************************************************/
+/* cpu budget */
+
+typedef struct {
+    int decoder_threads;    // 0 = libavcodec default
+    int encoder_threads;
+    int *cpus;              // cores to pin to; the first nb_decoder_cpus
+    int nb_cpus;            // are for decoding, the rest for encoding
+    int nb_decoder_cpus;
+} CpuBudget;
+
+/*
+ * Parse a cpu list such as "0-3,8,10-11".
+ * return the number of cpus, or -1 on error
+ */
+static int parse_cpu_list(const char *list, int **cpus)
+{
+    const char *p = list;
+    char *end;
+    long first, last, i;
+    int n = 0;
+
+    *cpus = malloc(MAX_CPUS * sizeof(int));
+    if (!*cpus) {
+        fprintf(stderr, "Could not allocate cpu list\n");
+        exit(1);
+    }
+
+    while (*p) {
+        first = last = strtol(p, &end, 10);
+        if (end == p)
+            return -1;
+        p = end;
+        if (*p == '-') {
+            last = strtol(++p, &end, 10);
+            if (end == p)
+                return -1;
+            p = end;
+        }
+        if (first < 0 || last < first || last >= MAX_CPUS || n + last - first + 1 > MAX_CPUS)
+            return -1;
+        for (i = first; i <= last; i++)
+            (*cpus)[n++] = (int)i;
+
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return -1;
+    }
+
+    return n;
+}
+
+/*
+ * Split max_threads (or, if 0, one thread per cpu) between the decoder and
+ * the encoder.  Decoding is much cheaper than encoding, so the decoder gets
+ * a quarter of the budget; without an encoder (raw output) it gets it all.
+ * A thread count of 1 runs that codec in the calling thread, so a budget of
+ * 1 gives one thread on each side and the whole split runs single-threaded.
+ */
+static void init_cpu_budget(CpuBudget *budget, int *cpus, int nb_cpus, int max_threads, int encode)
+{
+    int total = max_threads > 0 ? max_threads : nb_cpus;
+
+    memset(budget, 0, sizeof(CpuBudget));
+    budget->cpus = cpus;
+    budget->nb_cpus = nb_cpus;
+
+    if (total <= 0)
+        return;
+
+    if (!encode) {
+        budget->decoder_threads = total;
+        budget->nb_decoder_cpus = nb_cpus;
+        return;
+    }
+
+    budget->decoder_threads = FFMAX(total / 4, 1);
+    budget->encoder_threads = FFMAX(total - budget->decoder_threads, 1);
+
+    /* if there are too few cpus to split, both sides share all of them */
+    if (nb_cpus >= 2)
+        budget->nb_decoder_cpus = av_clip(nb_cpus * budget->decoder_threads /
+                                           (budget->decoder_threads + budget->encoder_threads),
+                                           1, nb_cpus - 1);
+}
+
+static void print_cpu_list(const int *cpus, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        printf("%s%d", i ? "," : "", cpus[i]);
+}
+
+static void print_cpu_budget(const CpuBudget *budget)
+{
+    if (budget->decoder_threads)
+        printf("Decoder threads: %d\n", budget->decoder_threads);
+    if (budget->encoder_threads)
+        printf("Encoder threads: %d\n", budget->encoder_threads);
+
+    if (budget->nb_cpus == 0)
+        return;
+
+    if (budget->nb_decoder_cpus == 0 || budget->nb_decoder_cpus == budget->nb_cpus) {
+        printf("CPUs: ");
+        print_cpu_list(budget->cpus, budget->nb_cpus);
+        printf("\n");
+    } else {
+        printf("Decoder CPUs: ");
+        print_cpu_list(budget->cpus, budget->nb_decoder_cpus);
+        printf("\nEncoder CPUs: ");
+        print_cpu_list(budget->cpus + budget->nb_decoder_cpus, budget->nb_cpus - budget->nb_decoder_cpus);
+        printf("\n");
+    }
+}
+
+/* Pin the calling thread; threads it creates inherit the mask */
+static void set_thread_affinity(const int *cpus, int n)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    int i, ret;
+
+    if (n == 0)
+        return;
+
+    CPU_ZERO(&set);
+    for (i = 0; i < n; i++)
+        CPU_SET(cpus[i], &set);
+
+    ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (ret != 0)
+        fprintf(stderr, "Warning: could not set thread affinity: %s\n", strerror(ret));
+#else
+    static int warned = 0;
+
+    if (n > 0 && !warned) {
+        fprintf(stderr, "Warning: thread pinning is not supported on this platform\n");
+        warned = 1;
+    }
+#endif
+}
+
+/*
+ * Limit the threads of a codec about to be opened, and pin the calling
+ * thread to the matching cpus, so the codec's worker threads started by
+ * avcodec_open2() are pinned too.  Call restore_cpu_affinity() afterwards.
+ */
+static void apply_cpu_budget(const CpuBudget *budget, AVCodecContext *c, int encoder)
+{
+    int nb_encoder_cpus;
+
+    if (!budget)
+        return;
+
+    if (!encoder) {
+        if (budget->decoder_threads)
+            c->thread_count = budget->decoder_threads;
+        set_thread_affinity(budget->cpus, budget->nb_decoder_cpus ? budget->nb_decoder_cpus : budget->nb_cpus);
+    } else {
+        if (budget->encoder_threads)
+            c->thread_count = budget->encoder_threads;
+        nb_encoder_cpus = budget->nb_cpus - budget->nb_decoder_cpus;
+        if (nb_encoder_cpus > 0)
+            set_thread_affinity(budget->cpus + budget->nb_decoder_cpus, nb_encoder_cpus);
+        else
+            set_thread_affinity(budget->cpus, budget->nb_cpus);
+    }
+}
+
+/* The main thread both decodes and encodes, so it may run on any budgeted cpu */
+static void restore_cpu_affinity(const CpuBudget *budget)
+{
+    if (budget)
+        set_thread_affinity(budget->cpus, budget->nb_cpus);
+}
+
 
 typedef struct {
     AVFormatContext *formatCtx;
@@ -81,7 +284,7 @@ int get_video_stream(AVFormatContext *formatCtx)
 }
 
 
-static DecoderContext *init_decoder(const char *filename)
+static DecoderContext *init_decoder(const char *filename, const CpuBudget *budget)
 {
     DecoderContext *dc = (DecoderContext *)calloc(1, sizeof(DecoderContext));
     AVCodecContext *codecCtx;
@@ -138,10 +341,12 @@ static DecoderContext *init_decoder(const char *filename)
        available in the bitstream. */
 
     /* open it */
+    apply_cpu_budget(budget, dc->codecCtx, 0);
     if (avcodec_open2(dc->codecCtx, dc->codec, NULL) < 0) {
         fprintf(stderr, "Could not open codec\n");
         exit(1);
     }
+    restore_cpu_affinity(budget);
 
     dc->frame = av_frame_alloc();
     if (!dc->frame) {
@@ -188,6 +393,19 @@ AVFrame *read_frame(DecoderContext *dc)
             break;
     }
 
+    /* At end of input, drain the frames still buffered in the decoder
+     * (reordering delay, or one per extra thread with frame threading) */
+    if (!got_frame) {
+        av_init_packet(&(dc->avpkt));
+        dc->avpkt.data = NULL;
+        dc->avpkt.size = 0;
+        ret = avcodec_decode_video2(dc->codecCtx, dc->frame, &got_frame, &(dc->avpkt));
+        if (ret < 0) {
+            fprintf(stderr, "unable to decode video frame...\n");
+            exit(1);
+        }
+    }
+
     fflush(stderr);
     if (!got_frame)
         return NULL;
@@ -200,6 +418,9 @@ static void close_decoder(DecoderContext *dc)
     av_frame_free(&(dc->frame));
     avcodec_close(dc->codecCtx);
     av_freep(&(dc->codecCtx));
+    avformat_close_input(&(dc->formatCtx));
+    free(dc->inbuf);
+    free(dc);
 }
 
 typedef struct OutputStream {
@@ -310,14 +531,17 @@ static AVFrame *alloc_picture(enum AVPixelFormat pix_fmt, int width, int height)
     return picture;
 }
 
-static void open_video(AVFormatContext *oc, AVCodec *codec, OutputStream *ost, AVDictionary *opt_arg)
+static void open_video(AVFormatContext *oc, AVCodec *codec, OutputStream *ost, AVDictionary *opt_arg,
+                       const CpuBudget *budget)
 {
     int ret;
     AVCodecContext *c = ost->st->codec;
     AVDictionary *opt = NULL;
     av_dict_copy(&opt, opt_arg, 0);
     /* open the codec */
+    apply_cpu_budget(budget, c, 1);
     ret = avcodec_open2(c, codec, &opt);
+    restore_cpu_affinity(budget);
     av_dict_free(&opt);
     if (ret < 0) {
         fprintf(stderr, "Could not open video codec: %s\n", av_err2str(ret));
@@ -358,8 +582,21 @@ typedef struct {
 } EncoderContext;
 
 
+/*
+ * Outputs restored from the cache are hardlinks to cache entries; unlink
+ * such a file before rewriting it, rather than truncating the shared inode.
+ */
+static void break_hardlink(const char *filename)
+{
+    struct stat st;
+
+    if (stat(filename, &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink > 1)
+        unlink(filename);
+}
+
 static EncoderContext *init_encoder(const char *filename, int gop_size, int width, int height,
-                                    AVRational framerate, enum AVPixelFormat pix_fmt, AVDictionary *_opt) {
+                                    AVRational framerate, enum AVPixelFormat pix_fmt, AVDictionary *_opt,
+                                    const CpuBudget *budget) {
 
     EncoderContext *ec = (EncoderContext *)calloc(1, sizeof(EncoderContext));
     int ret;
@@ -384,13 +621,14 @@ static EncoderContext *init_encoder(const char *filename, int gop_size, int widt
      * and initialize the codecs. */
     if (ec->fmt->video_codec != AV_CODEC_ID_NONE) {
         add_stream(&(ec->video_st), ec->oc, &(ec->videoCodec), ec->fmt->video_codec, gop_size, width, height, framerate, pix_fmt);
-        open_video(ec->oc, ec->videoCodec, &(ec->video_st), opt);
+        open_video(ec->oc, ec->videoCodec, &(ec->video_st), opt, budget);
     }
 
     //av_dump_format(ec->oc, 0, filename, 1);
 
     /* open the output file, if needed */
    if (!(ec->fmt->flags & AVFMT_NOFILE)) {
+        break_hardlink(filename);
         ret = avio_open(&(ec->oc->pb), filename, AVIO_FLAG_WRITE);
         if (ret < 0) {
             fprintf(stderr, "Could not open '%s': %s\n", filename,
@@ -526,30 +764,727 @@ static void set_pict_type(AVFrame *frame, int gop_size, int frame_count) {
 
 }
 
+/**************************************************************/
+/* raw video output */
+
+enum RawFormat {
+    RAW_NONE,
+    RAW_Y4M,
+    RAW_YUV
+};
+
+typedef struct {
+    int fd;
+    enum RawFormat format;
+    int nb_planes;
+    int plane_bytes[4];     // bytes per row
+    int plane_height[4];
+    struct iovec *iov;
+    int iov_size;
+} RawWriter;
+
+static const char *y4m_colorspace(enum AVPixelFormat pix_fmt)
+{
+    switch (pix_fmt) {
+    case AV_PIX_FMT_YUV420P:
+    case AV_PIX_FMT_YUVJ420P:
+        return "420jpeg";
+    case AV_PIX_FMT_YUV422P:
+    case AV_PIX_FMT_YUVJ422P:
+        return "422";
+    case AV_PIX_FMT_YUV444P:
+    case AV_PIX_FMT_YUVJ444P:
+        return "444";
+    case AV_PIX_FMT_GRAY8:
+        return "mono";
+    default:
+        return NULL;
+    }
+}
+
+/* Write all of iov, in batches of at most IOV_MAX */
+static void writev_all(int fd, struct iovec *iov, int count)
+{
+    ssize_t n;
+
+    while (count > 0) {
+        n = writev(fd, iov, FFMIN(count, IOV_MAX));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Error while writing raw video frame: %s\n", strerror(errno));
+            exit(1);
+        }
+
+        /* skip what was written, including a partially written entry */
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static RawWriter *init_raw_writer(const char *filename, enum RawFormat format, int width, int height,
+                                  AVRational framerate, enum AVPixelFormat pix_fmt)
+{
+    RawWriter *rw = (RawWriter *)calloc(1, sizeof(RawWriter));
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    const char *colorspace = NULL;
+    char header[256];
+    struct iovec iov;
+    int i;
+
+    if (!rw) {
+        fprintf(stderr, "Could not allocate raw writer\n");
+        exit(1);
+    }
+
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL))) {
+        fprintf(stderr, "Raw output does not support pixel format %s\n",
+                desc ? desc->name : "none");
+        exit(1);
+    }
+
+    if (format == RAW_Y4M) {
+        colorspace = y4m_colorspace(pix_fmt);
+        if (!colorspace) {
+            fprintf(stderr, "Y4M output does not support pixel format %s, use --raw yuv\n", desc->name);
+            exit(1);
+        }
+    }
+
+    rw->format = format;
+    rw->nb_planes = av_pix_fmt_count_planes(pix_fmt);
+    if (av_image_fill_linesizes(rw->plane_bytes, pix_fmt, width) < 0) {
+        fprintf(stderr, "Could not compute plane sizes\n");
+        exit(1);
+    }
+    for (i = 0; i < rw->nb_planes; i++)
+        rw->plane_height[i] = (i == 1 || i == 2) ? FF_CEIL_RSHIFT(height, desc->log2_chroma_h) : height;
+
+    /* one entry per row in the worst case, plus the Y4M frame header */
+    rw->iov_size = 1;
+    for (i = 0; i < rw->nb_planes; i++)
+        rw->iov_size += rw->plane_height[i];
+    rw->iov = malloc(rw->iov_size * sizeof(struct iovec));
+    if (!rw->iov) {
+        fprintf(stderr, "Could not allocate raw writer\n");
+        exit(1);
+    }
+
+    break_hardlink(filename);
+    rw->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (rw->fd < 0) {
+        fprintf(stderr, "Could not open '%s': %s\n", filename, strerror(errno));
+        exit(1);
+    }
+
+    if (format == RAW_Y4M) {
+        iov.iov_base = header;
+        iov.iov_len = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:%d Ip A0:0 C%s\n",
+                               width, height, framerate.num, framerate.den, colorspace);
+        writev_all(rw->fd, &iov, 1);
+    }
+
+    return rw;
+}
+
+/*
+ * write one decoded frame
+ * Planes are written directly from the frame buffers, without copying.
+ */
+static void write_raw_frame(RawWriter *rw, AVFrame *frame)
+{
+    static char frame_header[] = "FRAME\n";
+    int count = 0;
+    int i, y;
+
+    if (rw->format == RAW_Y4M) {
+        rw->iov[count].iov_base = frame_header;
+        rw->iov[count].iov_len = sizeof(frame_header) - 1;
+        count++;
+    }
+
+    for (i = 0; i < rw->nb_planes; i++) {
+        if (frame->linesize[i] == rw->plane_bytes[i]) {
+            /* contiguous plane */
+            rw->iov[count].iov_base = frame->data[i];
+            rw->iov[count].iov_len = (size_t)rw->plane_bytes[i] * rw->plane_height[i];
+            count++;
+        } else {
+            for (y = 0; y < rw->plane_height[i]; y++) {
+                rw->iov[count].iov_base = frame->data[i] + (ptrdiff_t)y * frame->linesize[i];
+                rw->iov[count].iov_len = rw->plane_bytes[i];
+                count++;
+            }
+        }
+    }
+
+    writev_all(rw->fd, rw->iov, count);
+}
+
+static void close_raw_writer(RawWriter *rw)
+{
+    if (close(rw->fd) != 0) {
+        fprintf(stderr, "Error while closing raw video file: %s\n", strerror(errno));
+        exit(1);
+    }
+    free(rw->iov);
+    free(rw);
+}
+
+/**************************************************************/
+/* scene-aware chunk planning */
+
+/*
+ * Mean absolute difference of the subsampled luma plane between two frames.
+ * thumb holds the previous frame's samples on entry and this frame's on exit.
+ * return the difference (0-255), or -1 when there is no previous frame
+ */
+static int scene_diff(AVFrame *frame, uint8_t *thumb, int have_prev)
+{
+    int x, y, n = 0;
+    long long sum = 0;
+    uint8_t *p = thumb;
+
+    for (y = 0; y + SCENE_SUBSAMPLE <= frame->height; y += SCENE_SUBSAMPLE) {
+        const uint8_t *row = frame->data[0] + y * frame->linesize[0];
+        for (x = 0; x + SCENE_SUBSAMPLE <= frame->width; x += SCENE_SUBSAMPLE) {
+            sum += FFABS(row[x] - *p);
+            *p++ = row[x];
+            n++;
+        }
+    }
+
+    if (!have_prev || n == 0)
+        return -1;
+    return (int)(sum / n);
+}
+
+/* scene_diff() reads the first plane as 8-bit luma */
+static int scene_detect_supported(enum AVPixelFormat pix_fmt)
+{
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(pix_fmt);
+    int depth;
+
+    if (!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL |
+                                 AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL)))
+        return 0;
+
+    if (!(desc->flags & AV_PIX_FMT_FLAG_PLANAR) && desc->nb_components > 1)
+        return 0;
+
+#if LIBAVUTIL_VERSION_MAJOR < 55
+    depth = desc->comp[0].depth_minus1 + 1;
+#else
+    depth = desc->comp[0].depth;
+#endif
+    return depth <= 8;
+}
+
+/*
+ * Decode the frames that will be split and choose chunk boundaries.
+ *
+ * Each boundary is moved to the detected scene cut nearest to chunk_size
+ * frames after the start of the chunk, within [min_chunk, max_chunk].  If
+ * there is no cut in range, the chunk is chunk_size frames long.
+ * return an array of *nb_chunks chunk lengths, or NULL if scene cuts cannot
+ * be detected for this input
+ */
+static int *plan_chunks(const char *infilename,
+                        int skip,
+                        long long length,
+                        int chunk_size,
+                        int min_chunk,
+                        int max_chunk,
+                        const CpuBudget *budget,
+                        int *nb_chunks)
+{
+    DecoderContext *dc;
+    AVFrame *frame;
+    uint8_t *thumb, *is_cut = NULL;
+    long long nb_frames = 0, capacity = 0, start, c, best;
+    int *chunks = NULL;
+    int nb_cuts = 0;
+
+    dc = init_decoder(infilename, budget);
+
+    if (!scene_detect_supported(dc->codecCtx->pix_fmt)) {
+        fprintf(stderr, "Warning: scene cut detection needs 8-bit planar YUV or gray input, not %s; "
+                "using fixed %d frame chunks\n",
+                av_get_pix_fmt_name(dc->codecCtx->pix_fmt) ? av_get_pix_fmt_name(dc->codecCtx->pix_fmt) : "none",
+                chunk_size);
+        close_decoder(dc);
+        *nb_chunks = 0;
+        return NULL;
+    }
+
+    thumb = malloc((dc->codecCtx->width / SCENE_SUBSAMPLE + 1) *
+                   (dc->codecCtx->height / SCENE_SUBSAMPLE + 1));
+    if (!thumb) {
+        fprintf(stderr, "Could not allocate scene buffer\n");
+        exit(1);
+    }
+
+    fprintf(stderr, "Detecting scene cuts\n");
+
+    while (skip > 0 && read_frame(dc))
+        --skip;
+
+    while (length <= 0 || nb_frames < length) {
+        frame = read_frame(dc);
+        if (!frame)
+            break;
+
+        if (nb_frames == capacity) {
+            capacity = capacity ? 2 * capacity : 4096;
+            is_cut = realloc(is_cut, capacity);
+            if (!is_cut) {
+                fprintf(stderr, "Could not allocate scene cut list\n");
+                exit(1);
+            }
+        }
+
+        is_cut[nb_frames] = scene_diff(frame, thumb, nb_frames > 0) > SCENE_CUT_THRESHOLD;
+        nb_cuts += is_cut[nb_frames];
+        nb_frames++;
+    }
+
+    close_decoder(dc);
+    free(thumb);
+
+    fprintf(stderr, "Found %d scene cuts in %lld frames\n", nb_cuts, nb_frames);
+
+    // Choose boundaries
+    chunks = malloc((nb_frames / FFMAX(min_chunk, 1) + 1) * sizeof(int));
+    if (!chunks) {
+        fprintf(stderr, "Could not allocate chunk list\n");
+        exit(1);
+    }
+
+    *nb_chunks = 0;
+    for (start = 0; start < nb_frames; start += chunks[(*nb_chunks)++]) {
+        if (nb_frames - start <= max_chunk) {
+            chunks[*nb_chunks] = (int)(nb_frames - start);
+            continue;
+        }
+
+        best = -1;
+        for (c = start + min_chunk; c <= start + max_chunk; c++) {
+            if (is_cut[c] && (best < 0 || FFABS(c - start - chunk_size) < FFABS(best - start - chunk_size)))
+                best = c;
+        }
+        chunks[*nb_chunks] = best < 0 ? chunk_size : (int)(best - start);
+    }
+
+    free(is_cut);
+
+    return chunks;
+}
+
+/**************************************************************/
+/* chunk cache */
+
+#define MD5_DIGEST_LEN 16
+#define CHUNK_KEY_LEN (2 * MD5_DIGEST_LEN + 1)
+
+typedef struct {
+    const char *dir;
+    const char *ext;
+    uint8_t params_digest[MD5_DIGEST_LEN];
+    uint8_t (*pkt_digest)[MD5_DIGEST_LEN];
+    uint8_t *pkt_key;
+    long long nb_packets;
+    int delay;
+    int hits;
+    int misses;
+} ChunkCache;
+
+static void md5_update_str(struct AVMD5 *md5, const char *s)
+{
+    /* include the terminator so that adjacent fields cannot run together */
+    av_md5_update(md5, (const uint8_t *)s, strlen(s) + 1);
+}
+
+/*
+ * Build a chunk cache rooted at dir.
+ *
+ * The input is demuxed once (without decoding) and an md5 digest is recorded
+ * for every video packet, in decode order.  A chunk key is later built from
+ * the digests of the packets a chunk depends on plus every parameter that
+ * affects the encoded output.
+ */
+static ChunkCache *init_chunk_cache(const char *dir,
+                                    const char *infilename,
+                                    const char *outfmt,
+                                    int gop_size,
+                                    int width, int height,
+                                    AVRational framerate,
+                                    enum AVPixelFormat pix_fmt,
+                                    int delay,
+                                    enum RawFormat raw_format,
+                                    const CpuBudget *budget,
+                                    AVDictionary *opt)
+{
+    ChunkCache *cc = (ChunkCache *)calloc(1, sizeof(ChunkCache));
+    AVFormatContext *formatCtx = NULL;
+    AVDictionaryEntry *e = NULL;
+    AVPacket pkt;
+    struct AVMD5 *md5;
+    long long capacity = 0;
+    int videoStream;
+    char buf[256];
+
+    if (!cc) {
+        fprintf(stderr, "Could not allocate chunk cache\n");
+        exit(1);
+    }
+
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create cache directory '%s': %s\n", dir, strerror(errno));
+        exit(1);
+    }
+
+    cc->dir = dir;
+    cc->ext = strrchr(outfmt, '.');
+    if (!cc->ext || strchr(cc->ext, '/'))
+        cc->ext = "";
+    cc->delay = delay;
+
+    md5 = av_md5_alloc();
+    if (!md5) {
+        fprintf(stderr, "Could not allocate md5 context\n");
+        exit(1);
+    }
+
+    /* Everything that changes the encoded bytes for identical input;
+     * e.g. libx264's output depends on its thread count */
+    av_md5_init(md5);
+    snprintf(buf, sizeof(buf), "%s %d %d %d/%d %d %dx%d %d/%d %s",
+             LIBAVCODEC_IDENT, LIBAVFORMAT_VERSION_INT, raw_format,
+             budget ? budget->decoder_threads : 0, budget ? budget->encoder_threads : 0, gop_size,
+             width, height, framerate.num, framerate.den,
+             av_get_pix_fmt_name(pix_fmt) ? av_get_pix_fmt_name(pix_fmt) : "none");
+    md5_update_str(md5, buf);
+    md5_update_str(md5, cc->ext);
+    while ((e = av_dict_get(opt, "", e, AV_DICT_IGNORE_SUFFIX))) {
+        md5_update_str(md5, e->key);
+        md5_update_str(md5, e->value);
+    }
+    av_md5_final(md5, cc->params_digest);
+
+    // Hash the input video packets
+    if (avformat_open_input(&formatCtx, infilename, NULL, NULL) != 0) {
+        fprintf(stderr, "Couldn't open file");
+        exit(1);
+    }
+
+    if (avformat_find_stream_info(formatCtx, NULL) < 0) {
+        fprintf(stderr, "Couldn't find stream information");
+        exit(1);
+    }
+
+    videoStream = get_video_stream(formatCtx);
+    if (videoStream == -1) {
+        fprintf(stderr, "Couldn't find video stream");
+        exit(1);
+    }
+
+    while (av_read_frame(formatCtx, &pkt) == 0) {
+        if (pkt.stream_index == videoStream) {
+            if (cc->nb_packets == capacity) {
+                capacity = capacity ? 2 * capacity : 4096;
+                cc->pkt_digest = realloc(cc->pkt_digest, capacity * MD5_DIGEST_LEN);
+                cc->pkt_key = realloc(cc->pkt_key, capacity);
+                if (!cc->pkt_digest || !cc->pkt_key) {
+                    fprintf(stderr, "Could not allocate packet digests\n");
+                    exit(1);
+                }
+            }
+            av_md5_sum(cc->pkt_digest[cc->nb_packets], pkt.data, pkt.size);
+            cc->pkt_key[cc->nb_packets] = !!(pkt.flags & AV_PKT_FLAG_KEY);
+            cc->nb_packets++;
+        }
+        av_free_packet(&pkt);
+    }
+
+    avformat_close_input(&formatCtx);
+    av_free(md5);
+
+    cc->hits = 0;
+    cc->misses = 0;
+
+    return cc;
+}
+
+/*
+ * Compute the cache key for the chunk made of nb_frames decoded frames
+ * starting at input frame first_frame.
+ *
+ * Assumes one video packet per frame.  The decoded frames depend on every
+ * packet from the preceding keyframe (or the one before it, if the decoder
+ * reorders frames) up to the end of the chunk, plus the packets held back by
+ * the decoder's reorder delay.
+ */
+static void chunk_cache_key(ChunkCache *cc, long long first_frame, long long nb_frames, char *key)
+{
+    struct AVMD5 *md5 = av_md5_alloc();
+    uint8_t digest[MD5_DIGEST_LEN];
+    long long start, end, i;
+    char buf[64];
+
+    if (!md5) {
+        fprintf(stderr, "Could not allocate md5 context\n");
+        exit(1);
+    }
+
+    if (first_frame > cc->nb_packets)
+        first_frame = cc->nb_packets;
+    if (nb_frames > cc->nb_packets - first_frame)
+        nb_frames = cc->nb_packets - first_frame;
+
+    start = first_frame;
+    while (start > 0 && (start >= cc->nb_packets || !cc->pkt_key[start]))
+        --start;
+    /* with reordering (B-frames, open GOPs), the leading frames of a GOP may
+     * reference the previous one */
+    if (cc->delay > 0 && start > 0) {
+        --start;
+        while (start > 0 && !cc->pkt_key[start])
+            --start;
+    }
+    end = FFMIN(first_frame + nb_frames + cc->delay, cc->nb_packets);
+
+    av_md5_init(md5);
+    av_md5_update(md5, cc->params_digest, MD5_DIGEST_LEN);
+    snprintf(buf, sizeof(buf), "%lld %lld", first_frame - start, nb_frames);
+    md5_update_str(md5, buf);
+    for (i = start; i < end; i++)
+        av_md5_update(md5, cc->pkt_digest[i], MD5_DIGEST_LEN);
+    av_md5_final(md5, digest);
+    av_free(md5);
+
+    for (i = 0; i < MD5_DIGEST_LEN; i++)
+        snprintf(key + 2 * i, 3, "%02x", digest[i]);
+}
+
+static void chunk_cache_path(ChunkCache *cc, const char *key, char *path)
+{
+    /* a truncated path could map different keys to one entry */
+    if (snprintf(path, MAX_FILENAME_LEN, "%s/%s%s", cc->dir, key, cc->ext) >= MAX_FILENAME_LEN) {
+        fprintf(stderr, "Cache path too long: '%s'\n", cc->dir);
+        exit(1);
+    }
+}
+
+static int copy_file(const char *src, const char *dst)
+{
+    char buf[65536];
+    size_t n;
+    int ret = 0;
+    FILE *in, *out;
+
+    in = fopen(src, "rb");
+    if (!in)
+        return -1;
+    out = fopen(dst, "wb");
+    if (!out) {
+        fclose(in);
+        return -1;
+    }
+
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n) {
+            ret = -1;
+            break;
+        }
+    }
+    if (ferror(in))
+        ret = -1;
+
+    fclose(in);
+    if (fclose(out) != 0)
+        ret = -1;
+    return ret;
+}
+
+/* Hardlink src to dst if possible, otherwise copy it */
+static int link_or_copy(const char *src, const char *dst)
+{
+    unlink(dst);
+    if (link(src, dst) == 0)
+        return 0;
+    return copy_file(src, dst);
+}
+
+/*
+ * Restore a cached chunk to outfilename.
+ * return 1 on a cache hit, 0 otherwise
+ */
+static int chunk_cache_fetch(ChunkCache *cc, const char *key, const char *outfilename)
+{
+    char path[MAX_FILENAME_LEN];
+
+    chunk_cache_path(cc, key, path);
+    if (access(path, R_OK) == 0 && link_or_copy(path, outfilename) == 0) {
+        cc->hits++;
+        return 1;
+    }
+
+    cc->misses++;
+    return 0;
+}
+
+/* Add a freshly encoded chunk to the cache */
+static void chunk_cache_store(ChunkCache *cc, const char *key, const char *outfilename)
+{
+    char path[MAX_FILENAME_LEN];
+    char tmppath[MAX_FILENAME_LEN];
+
+    int fd;
+
+    chunk_cache_path(cc, key, path);
+    if (snprintf(tmppath, MAX_FILENAME_LEN, "%s.XXXXXX", path) >= MAX_FILENAME_LEN) {
+        fprintf(stderr, "Cache path too long: '%s'\n", cc->dir);
+        exit(1);
+    }
+
+    /* The temporary name is unique to this writer, so jobs sharing a cache
+     * cannot clobber each other's entry before it is published */
+    fd = mkstemp(tmppath);
+    if (fd < 0) {
+        fprintf(stderr, "\nWarning: could not add '%s' to cache: %s\n", outfilename, strerror(errno));
+        return;
+    }
+    close(fd);
+
+    /* Publish atomically, so an interrupted run never leaves a partial entry.
+     * Like a hit, the entry is a read-only hardlink to the output when
+     * possible; break_hardlink() keeps later runs from writing through it. */
+    if (link_or_copy(outfilename, tmppath) != 0 || chmod(tmppath, 0444) != 0 ||
+        rename(tmppath, path) != 0) {
+        fprintf(stderr, "\nWarning: could not add '%s' to cache: %s\n", outfilename, strerror(errno));
+        unlink(tmppath);
+    }
+}
+
+static void close_chunk_cache(ChunkCache *cc)
+{
+    free(cc->pkt_digest);
+    free(cc->pkt_key);
+    free(cc);
+}
+
+/*
+ * Start writing a chunk to outfilename.
+ * Sets *ec (or *rw, for raw output) to the writer for the chunk, or both to
+ * NULL if it was restored from the cache.
+ */
+static void begin_chunk(const char *outfilename, ChunkCache *cc, char *key,
+                        long long first_frame, long long nb_frames,
+                        int gop_size, int width, int height,
+                        AVRational framerate, enum AVPixelFormat pix_fmt, AVDictionary *opt,
+                        enum RawFormat raw_format, const CpuBudget *budget,
+                        EncoderContext **ec, RawWriter **rw)
+{
+    *ec = NULL;
+    *rw = NULL;
+
+    if (cc) {
+        chunk_cache_key(cc, first_frame, nb_frames, key);
+        if (chunk_cache_fetch(cc, key, outfilename))
+            return;
+    }
+
+    if (raw_format != RAW_NONE)
+        *rw = init_raw_writer(outfilename, raw_format, width, height, framerate, pix_fmt);
+    else
+        *ec = init_encoder(outfilename, gop_size, width, height, framerate, pix_fmt, opt, budget);
+}
+
+static void end_chunk(EncoderContext *ec, RawWriter *rw, ChunkCache *cc, const char *key, const char *outfilename)
+{
+    if (ec)
+        close_encoder(ec);
+    else if (rw)
+        close_raw_writer(rw);
+    else
+        return;
+
+    if (cc)
+        chunk_cache_store(cc, key, outfilename);
+}
+
+static int planned_chunk_len(const int *plan, int nb_planned, int chunk_num, int chunk_size)
+{
+    return (plan && chunk_num < nb_planned) ? plan[chunk_num] : chunk_size;
+}
+
+static void write_manifest_entry(FILE *manifest, int chunk_num, long long first_frame,
+                                 long long nb_frames, const char *outfilename)
+{
+    if (manifest)
+        fprintf(manifest, "%d\t%lld\t%lld\t%s\n", chunk_num, first_frame, nb_frames, outfilename);
+}
+
 static void split_video(const char *infilename,
                         const char *outfmt,
                         int gop_size,
                         int chunk_size,
+                        int min_chunk,
+                        int max_chunk,
                         int skip,
                         long long length,
+                        const char *manifest_file,
+                        const char *cache_dir,
+                        enum RawFormat raw_format,
+                        const CpuBudget *budget,
                         AVDictionary *_opt)
 {
     DecoderContext *dc;
     EncoderContext *ec;
+    RawWriter *rw;
+    ChunkCache *cc = NULL;
+    FILE *manifest = NULL;
+    int *plan = NULL;
+    int nb_planned = 0;
 
     AVFrame *frame;
     int width, height;
     long long frame_count = 0, out_frame_num = 0;
+    long long first_frame = skip;
+    long long chunk_len;
     int chunk_count = 0;
     char outfilename[MAX_FILENAME_LEN];
+    char key[CHUNK_KEY_LEN];
     AVDictionary *opt = NULL;
     AVRational framerate;
     enum AVPixelFormat pix_fmt;
 
     av_dict_copy(&opt, _opt, 0);
 
+    // Choose scene-aware chunk boundaries
+    if (min_chunk > 0)
+        plan = plan_chunks(infilename, skip, length, chunk_size, min_chunk, max_chunk, budget, &nb_planned);
+    if (plan)
+        printf("Chunk size range: %d-%d (at scene cuts)\n", min_chunk, max_chunk);
+
+    if (manifest_file) {
+        manifest = fopen(manifest_file, "w");
+        if (!manifest) {
+            fprintf(stderr, "Could not open manifest '%s': %s\n", manifest_file, strerror(errno));
+            exit(1);
+        }
+        fprintf(manifest, "# chunk\tfirst_frame\tframes\tfile\n");
+    }
+
     // Initialize the decoder
-    dc = init_decoder(infilename);
+    dc = init_decoder(infilename, budget);
 
     // Extract parms needed by encoder
     width = dc->codecCtx->width;
@@ -557,6 +1492,10 @@ static void split_video(const char *infilename,
     framerate = dc->codecCtx->framerate;
     pix_fmt = dc->codecCtx->pix_fmt;
 
+    if (cache_dir)
+        cc = init_chunk_cache(cache_dir, infilename, outfmt, gop_size, width, height,
+                              framerate, pix_fmt, dc->codecCtx->has_b_frames, raw_format, budget, opt);
+
     // Skip input frames
 
     if (skip > 0)
@@ -576,22 +1515,30 @@ static void split_video(const char *infilename,
     fprintf(stderr, "\rWriting chunk %05d", chunk_count);
     fflush(stderr);
 
+    chunk_len = planned_chunk_len(plan, nb_planned, chunk_count, chunk_size);
     snprintf(outfilename, MAX_FILENAME_LEN, outfmt, chunk_count++);
-    ec = init_encoder(outfilename, gop_size, width, height, framerate, pix_fmt, opt);
+    begin_chunk(outfilename, cc, key, first_frame,
+                length > 0 ? FFMIN(chunk_len, length) : chunk_len,
+                gop_size, width, height, framerate, pix_fmt, opt, raw_format, budget, &ec, &rw);
 
     while (length <= 0 || frame_count < length) {
         frame = read_frame(dc);
         if (!frame)
             break;
 
-        if (out_frame_num == chunk_size) {
-            close_encoder(ec);
+        if (out_frame_num == chunk_len) {
+            end_chunk(ec, rw, cc, key, outfilename);
+            write_manifest_entry(manifest, chunk_count - 1, first_frame + frame_count - out_frame_num,
+                                 out_frame_num, outfilename);
 
             fprintf(stderr, "\rWriting chunk %05d", chunk_count);
             fflush(stderr);
 
+            chunk_len = planned_chunk_len(plan, nb_planned, chunk_count, chunk_size);
             snprintf(outfilename, MAX_FILENAME_LEN, outfmt, chunk_count++);
-            ec = init_encoder(outfilename, gop_size, width, height, framerate, pix_fmt, opt);
+            begin_chunk(outfilename, cc, key, first_frame + frame_count,
+                        length > 0 ? FFMIN(chunk_len, length - frame_count) : chunk_len,
+                        gop_size, width, height, framerate, pix_fmt, opt, raw_format, budget, &ec, &rw);
             out_frame_num = 0;
         }
 
@@ -599,15 +1546,36 @@ static void split_video(const char *infilename,
         frame->pts = out_frame_num++;
         frame_count++;
 
-        write_video_frame(ec, frame);
+        // Cached chunks are still decoded, to keep the decoder in step
+        if (rw)
+            write_raw_frame(rw, frame);
+        else if (ec)
+            write_video_frame(ec, frame);
     }
 
-    close_encoder(ec);
+    end_chunk(ec, rw, cc, key, outfilename);
+    write_manifest_entry(manifest, chunk_count - 1, first_frame + frame_count - out_frame_num,
+                         out_frame_num, outfilename);
     close_decoder(dc);
 
     fprintf(stderr, "\nRead %lld frames\n", frame_count);
-    fprintf(stderr, "Wrote %d chunks of %d frames each (last chunk: %lld frames)\n", chunk_count, chunk_size, out_frame_num);
-    fprintf(stderr, "  for a total of %lld frames\n", (chunk_count-1) * chunk_size + out_frame_num);
+    if (plan) {
+        fprintf(stderr, "Wrote %d chunks of %d to %d frames each (last chunk: %lld frames)\n",
+                chunk_count, min_chunk, max_chunk, out_frame_num);
+        fprintf(stderr, "  for a total of %lld frames\n", frame_count);
+        free(plan);
+    } else {
+        fprintf(stderr, "Wrote %d chunks of %d frames each (last chunk: %lld frames)\n", chunk_count, chunk_size, out_frame_num);
+        fprintf(stderr, "  for a total of %lld frames\n", (chunk_count-1) * chunk_size + out_frame_num);
+    }
+
+    if (manifest)
+        fclose(manifest);
+
+    if (cc) {
+        fprintf(stderr, "Cache: %d hits, %d misses\n", cc->hits, cc->misses);
+        close_chunk_cache(cc);
+    }
 }
 
 void print_help(const char * prog_name) {
@@ -617,7 +1585,10 @@ void print_help(const char * prog_name) {
            "    Usage:\n"
            "\n"
            "        %s [--gop-size 30] [--chunk-size 120] [--skip 123]\n"
-           "                  [--length 1200] input_file output_template\n"
+           "                  [--length 1200] [--min-chunk 90] [--max-chunk 180]\n"
+           "                  [--manifest FILE] [--cache DIR] [--raw y4m|yuv]\n"
+           "                  [--cpus 0-3,8] [--max-threads 4]\n"
+           "                  input_file output_template\n"
            "\n"
            "    where\n"
            "\n"
@@ -626,6 +1597,20 @@ void print_help(const char * prog_name) {
            "        --skip       are the number of frames to skip at the\n"
            "                     beginning of the input file\n"
            "        --length     are the number of frames to encode\n"
+           "        --min-chunk  with --max-chunk, moves each chunk boundary to the\n"
+           "        --max-chunk  scene cut nearest to --chunk-size frames, keeping\n"
+           "                     chunks between these sizes\n"
+           "        --manifest   is a file listing each chunk's first frame,\n"
+           "                     frame count and file name\n"
+           "        --cache      is a directory of previously encoded chunks; chunks\n"
+           "                     whose input and settings are unchanged are copied\n"
+           "                     from it instead of being re-encoded\n"
+           "        --raw        writes decoded frames as Y4M or raw planar YUV,\n"
+           "                     without encoding\n"
+           "        --cpus       pins decoder and encoder threads to these cores\n"
+           "        --max-threads\n"
+           "                     is the total number of decoder and encoder\n"
+           "                     threads (default: one per --cpus core)\n"
            "\n"
            "    Example:\n"
            "\n"
@@ -645,7 +1630,17 @@ int main(int argc, char **argv)
     int gop_size = 30;
     int chunk_size = 120;
     int skip = 0;
+    int min_chunk = 0;
+    int max_chunk = 0;
     long long length = -1;
+    const char *manifest_file = NULL;
+    const char *cache_dir = NULL;
+    enum RawFormat raw_format = RAW_NONE;
+    const char *cpu_list = NULL;
+    int *cpus = NULL;
+    int nb_cpus = 0;
+    int max_threads = 0;
+    CpuBudget budget;
     int c;
     static int help = 0;
     char *end;
@@ -659,13 +1654,20 @@ int main(int argc, char **argv)
           {"chunk-size",  required_argument, 0, 'c'},
           {"skip", required_argument, 0, 's'},
           {"length", required_argument, 0, 'n'},
+          {"min-chunk", required_argument, 0, 'm'},
+          {"max-chunk", required_argument, 0, 'M'},
+          {"manifest", required_argument, 0, 'f'},
+          {"cache", required_argument, 0, 'C'},
+          {"raw", required_argument, 0, 'r'},
+          {"cpus", required_argument, 0, 'p'},
+          {"max-threads", required_argument, 0, 't'},
           {"help", no_argument, &help, 'h'},
           {0, 0, 0, 0}
         };
       /* getopt_long stores the option index here. */
       int option_index = 0;
 
-      c = getopt_long (argc, argv, "g:c:s:n:h",
+      c = getopt_long (argc, argv, "g:c:s:n:m:M:f:C:r:p:t:h",
                        long_options, &option_index);
 
       /* Detect the end of the options. */
@@ -690,6 +1692,41 @@ int main(int argc, char **argv)
             length = strtoul(optarg, &end, 10);
             break;
 
+        case 'm':
+            min_chunk = (int)strtoul(optarg, &end, 10);
+            break;
+
+        case 'M':
+            max_chunk = (int)strtoul(optarg, &end, 10);
+            break;
+
+        case 'f':
+            manifest_file = optarg;
+            break;
+
+        case 'C':
+            cache_dir = optarg;
+            break;
+
+        case 'r':
+            if (!strcmp(optarg, "y4m"))
+                raw_format = RAW_Y4M;
+            else if (!strcmp(optarg, "yuv"))
+                raw_format = RAW_YUV;
+            else {
+                fprintf(stderr, "unknown raw format '%s' (use y4m or yuv)\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'p':
+            cpu_list = optarg;
+            break;
+
+        case 't':
+            max_threads = (int)strtoul(optarg, &end, 10);
+            break;
+
         case 'h':
             print_help(argv[0]);
             exit(0);
@@ -709,6 +1746,27 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (min_chunk > 0 || max_chunk > 0) {
+        if (min_chunk <= 0)
+            min_chunk = chunk_size;
+        if (max_chunk <= 0)
+            max_chunk = chunk_size;
+
+        if (min_chunk > chunk_size || max_chunk < chunk_size) {
+            fprintf(stderr, "chunk size (%d) must be between min chunk (%d) and max chunk (%d)",
+                    chunk_size, min_chunk, max_chunk);
+            return 1;
+        }
+    }
+
+    if (cpu_list) {
+        nb_cpus = parse_cpu_list(cpu_list, &cpus);
+        if (nb_cpus <= 0) {
+            fprintf(stderr, "invalid cpu list '%s'\n", cpu_list);
+            return 1;
+        }
+    }
+
     if (argc - optind != 2) {
         print_help(argv[0]);
         return 1;
@@ -720,6 +1778,9 @@ int main(int argc, char **argv)
     printf("GOP size: %d\n", gop_size);
     printf("Chunk size: %d\n", chunk_size);
 
+    init_cpu_budget(&budget, cpus, nb_cpus, max_threads, raw_format == RAW_NONE);
+    print_cpu_budget(&budget);
+
     av_dict_set(&opt, "crf", "18", 0);
     av_dict_set(&opt, "movflags", "faststart", 0);
 
@@ -728,7 +1789,8 @@ int main(int argc, char **argv)
     avcodec_register_all();
     av_log_set_level(AV_LOG_WARNING);
 
-    split_video(input_file, output_template, gop_size, chunk_size, skip, length, opt);
+    split_video(input_file, output_template, gop_size, chunk_size, min_chunk, max_chunk,
+                skip, length, manifest_file, cache_dir, raw_format, &budget, opt);
 
     return 0;
 }